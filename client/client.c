@@ -8,8 +8,12 @@ Given a url and a port, this program will send an http GET request to that
 address, and print the webpage it returns to stdout
 
 if the -p flag is given, this program also calculates the round trip time
+
+if -n is given, this program sends that many requests down one pipelined
+connection instead, see pipeline.c
 */
 #include "get_socket.h"
+#include "pipeline.h"
 #include <time.h>
 
 
@@ -124,7 +128,11 @@ int get_content_len(char* buffer, int* length) {
 	 Prints a brief message telling people how to call the program
  */
 void usage() {
-	printf("Usage: client [options] URL PORT\n");
+	printf("Usage: client [options] URL PORT [PATH ...]\n");
+	printf("\t-p\t\tprint the round trip time\n");
+	printf("\t-n COUNT\tpipeline COUNT requests for URL and each PATH in turn\n");
+	printf("\t-d DEPTH\tkeep at most DEPTH pipelined requests in flight (default 8)\n");
+	printf("\t-s\t\tuse a new connection for each request instead of pipelining\n");
 }
 
 /*
@@ -132,29 +140,55 @@ void usage() {
 	 a lot ended up in main(), so i'll comment as i go
  */
 int main(int argc, char* argv[]) {
-	int print;
+	int print = 0;
+	int count = 0;
+	int depth = 8;
+	int depth_given = 0;
+	int per_connection = 0;
+	int opt;
 	struct timespec t_start;
 	struct timespec t_end;
 
-	//four args means flags must have been given
-	if(argc == 4) {
-		if(strcmp(argv[1], "-p") == 0) {
-			//-p flag, we need to time this run
-			//set the variable and start the clock
-			print = 1;
-			clock_gettime(CLOCK_MONOTONIC, &t_start);
-		} else {
-			usage();
-			return -1;
+	while((opt = getopt(argc, argv, "pn:d:s")) != -1) {
+		switch(opt) {
+			case 'p':
+				//-p flag, we need to time this run
+				print = 1;
+				break;
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'd':
+				depth = atoi(optarg);
+				depth_given = 1;
+				break;
+			case 's':
+				per_connection = 1;
+				break;
+			default:
+				usage();
+				return -1;
 		}
-	} else if (argc == 3) {
-		print = 0;
-	} else {
+	}
+	//Only pipelined runs can take more than one path, or use -d and -s
+	//and they print their own timings, so -p only goes with single requests
+	if(argc - optind < 2 || count < 0 || depth < 1) {
+		usage();
+		return -1;
+	}
+	if(count == 0 && (argc - optind != 2 || depth_given || per_connection)) {
 		usage();
 		return -1;
 	}
+	if(count > 0 && print) {
+		printf("-p can not be used with -n, pipelined runs always print their timings\n");
+		return -1;
+	}
+	if(print) {
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+	}
 	//Retrieve hostname and what file we want, if nothing is present after the hostname, assume we wanted /
-	char* host = argv[argc-2];
+	char* host = argv[optind];
 	char* file = strchr(host, '/');
 	if(file) {
 		*file = '\0';
@@ -162,12 +196,26 @@ int main(int argc, char* argv[]) {
 	} else {
 		file = "";
 	}
+	char* port = argv[optind+1];
+
+	//Pipelined runs request the URL's path, then any extra paths, over and over
+	if(count > 0) {
+		int num_paths = argc - optind - 1;
+		char* paths[num_paths];
+		paths[0] = file;
+		for(int i = 1; i < num_paths; i++) {
+			paths[i] = argv[optind+1+i];
+			if(paths[i][0] == '/') {
+				++paths[i];
+			}
+		}
+		return run_pipeline(host, port, paths, num_paths, count, depth, per_connection);
+	}
 
 	//put the entire request in one string, and store it for later
 	char input[100 + strlen(host) + strlen(file)];
 	input[0] = '\0';
 	sprintf(input, "GET /%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: curl/1.0\r\nConnection: close\r\n\r\n", file, host);
-	char* port = argv[argc-1];
 
 	int s;
 	if(get_socket(host, port, &s, 0) != 0) {
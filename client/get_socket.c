@@ -6,17 +6,241 @@ Date: 18-9-2014
 Methods common to client.c and server.c
 right now, it is just the get_socket() function, but any future functions that are used
 by both client.c and server.c should go in here
+
+Clients connect with a "Happy Eyeballs" race (RFC 8305): every address the host
+resolves to gets a non-blocking connect, started CONNECT_STAGGER_MS apart, and
+the first one to finish wins. Resolutions are kept in a small cache for
+DNS_CACHE_TTL seconds, so runs that connect over and over only ask the resolver once
 */
 
 #include "get_socket.h"
 
+//An address we can try to connect to, copied out of getaddrinfo's results
+struct candidate {
+	int family;
+	socklen_t addrlen;
+	struct sockaddr_storage addr;
+};
+
+struct dns_cache_entry {
+	char* host;
+	char* port;
+	struct candidate candidates[MAX_CANDIDATES];
+	int num_candidates;
+	struct timespec expires;
+};
+
+static struct dns_cache_entry dns_cache[DNS_CACHE_SIZE];
+static pthread_mutex_t dns_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+	 @return: the number of milliseconds from a to b, negative if b is earlier
+ */
+static long ms_between(struct timespec* a, struct timespec* b) {
+	return 1000*(b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec)/1000000;
+}
+
+/*
+	 Turns the list getaddrinfo gives back into an array of candidates
+	 The families are interleaved, IPv6 first, so that if one whole family is
+	 broken we only lose one stagger delay before trying the other
+
+	 @return: the number of candidates filled in
+ */
+static int order_candidates(struct addrinfo* res, struct candidate* candidates) {
+	struct addrinfo* temp;
+	struct addrinfo* v6[MAX_CANDIDATES];
+	struct addrinfo* v4[MAX_CANDIDATES];
+	int num_v6 = 0, num_v4 = 0, n = 0;
+	for(temp = res; temp; temp = temp->ai_next) {
+		if(temp->ai_family == AF_INET6 && num_v6 < MAX_CANDIDATES) {
+			v6[num_v6++] = temp;
+		} else if(temp->ai_family == AF_INET && num_v4 < MAX_CANDIDATES) {
+			v4[num_v4++] = temp;
+		}
+	}
+	for(int i = 0; n < MAX_CANDIDATES && (i < num_v6 || i < num_v4); i++) {
+		struct addrinfo* pair[2] = { i < num_v6 ? v6[i] : NULL, i < num_v4 ? v4[i] : NULL };
+		for(int j = 0; j < 2 && n < MAX_CANDIDATES; j++) {
+			if(pair[j]) {
+				candidates[n].family = pair[j]->ai_family;
+				candidates[n].addrlen = pair[j]->ai_addrlen;
+				memcpy(&candidates[n].addr, pair[j]->ai_addr, pair[j]->ai_addrlen);
+				++n;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+	 Resolves a host and port to a list of candidates, using the cache if we
+	 have looked this host up in the last DNS_CACHE_TTL seconds
+	 Failed lookups are not cached
+
+	 @param host: the hostname e.g. "www.cnn.com"
+	 @param port: the port we want to connect on e.g. "80"
+	 @param candidates: filled with up to MAX_CANDIDATES addresses
+
+	 @return: the number of candidates, or -1 on failure
+ */
+static int resolve_cached(char* host, char* port, struct candidate* candidates) {
+	struct timespec now;
+	int n;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	pthread_mutex_lock(&dns_cache_lock);
+	for(int i = 0; i < DNS_CACHE_SIZE; i++) {
+		struct dns_cache_entry* e = &dns_cache[i];
+		if(e->host && strcmp(e->host, host) == 0 && strcmp(e->port, port) == 0 && ms_between(&now, &e->expires) > 0) {
+			memcpy(candidates, e->candidates, e->num_candidates * sizeof(*candidates));
+			n = e->num_candidates;
+			pthread_mutex_unlock(&dns_cache_lock);
+			return n;
+		}
+	}
+	pthread_mutex_unlock(&dns_cache_lock);
+
+	struct addrinfo hints, *res;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = 0;
+	hints.ai_flags = 0;
+	int result = getaddrinfo(host, port, &hints, &res);
+	if (result != 0) {
+		printf("%s\n", gai_strerror(result));
+		return -1;
+	}
+	n = order_candidates(res, candidates);
+	freeaddrinfo(res);
+
+	//Replace whichever entry expires soonest, empty and stale entries go first
+	pthread_mutex_lock(&dns_cache_lock);
+	struct dns_cache_entry* victim = &dns_cache[0];
+	for(int i = 0; i < DNS_CACHE_SIZE && victim->host; i++) {
+		if(!dns_cache[i].host || ms_between(&dns_cache[i].expires, &victim->expires) > 0) {
+			victim = &dns_cache[i];
+		}
+	}
+	free(victim->host);
+	free(victim->port);
+	victim->host = strdup(host);
+	victim->port = strdup(port);
+	memcpy(victim->candidates, candidates, n * sizeof(*candidates));
+	victim->num_candidates = n;
+	victim->expires = now;
+	victim->expires.tv_sec += DNS_CACHE_TTL;
+	pthread_mutex_unlock(&dns_cache_lock);
+	return n;
+}
+
+/*
+	 Races connections to all of the candidates
+	 A non-blocking connect is started on the first candidate, and each time
+	 CONNECT_STAGGER_MS passes without a winner, or an attempt fails, the next
+	 one is started. The first connection to complete is kept, and the rest are closed.
+
+	 @param candidates: the addresses to try, in order
+	 @param n: how many candidates there are
+	 @param s: where we put the socket that connected
+
+	 @return: -1 on failure, 0 on success
+ */
+static int race_connect(struct candidate* candidates, int n, int* s) {
+	struct pollfd fds[MAX_CANDIDATES];
+	struct timespec now, next_start;
+	int pending = 0;
+	int started = 0;
+	int yes = 1;
+	*s = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &next_start);
+	while(*s == -1 && (started < n || pending > 0)) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		//Time for the next attempt, or nothing is left in flight to wait for
+		if(started < n && (pending == 0 || ms_between(&now, &next_start) <= 0)) {
+			struct candidate* c = &candidates[started++];
+			int fd = socket(c->family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if(fd == -1) {
+				printf("Socket error\n");
+				continue;
+			}
+			//Allows us to reuse ports as they wait for the kernel to clear them
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+			if(connect(fd, (struct sockaddr*)&c->addr, c->addrlen) == 0) {
+				*s = fd;
+				break;
+			}
+			if(errno != EINPROGRESS) {
+				close(fd);
+				continue;
+			}
+			fds[pending].fd = fd;
+			fds[pending].events = POLLOUT;
+			++pending;
+			next_start = now;
+			next_start.tv_nsec += CONNECT_STAGGER_MS * 1000000L;
+			if(next_start.tv_nsec >= 1000000000L) {
+				next_start.tv_sec += 1;
+				next_start.tv_nsec -= 1000000000L;
+			}
+			continue;
+		}
+
+		//Wait for an attempt to finish, or until the next one is due
+		int timeout = -1;
+		if(started < n) {
+			timeout = ms_between(&now, &next_start);
+			timeout = timeout < 0 ? 0 : timeout;
+		}
+		if(poll(fds, pending, timeout) == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		for(int i = 0; i < pending; i++) {
+			if(fds[i].revents == 0) {
+				continue;
+			}
+			int err = 0;
+			socklen_t err_len = sizeof(err);
+			getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+			if(err == 0) {
+				*s = fds[i].fd;
+				fds[i] = fds[--pending];
+				break;
+			}
+			//This one failed, so don't make the next one wait out the stagger
+			close(fds[i].fd);
+			fds[i--] = fds[--pending];
+			next_start = now;
+		}
+	}
+
+	//Whichever attempts lost the race are closed
+	for(int i = 0; i < pending; i++) {
+		close(fds[i].fd);
+	}
+	if(*s == -1) {
+		return -1;
+	}
+	//The rest of the client expects an ordinary blocking socket
+	fcntl(*s, F_SETFL, fcntl(*s, F_GETFL) & ~O_NONBLOCK);
+	return 0;
+}
+
 /*
 	 Given a host and a destination port, gets a socket
 
-	 This function uses getaddrinfo to find an appropriate socket
+	 Clients resolve the host with resolve_cached(), then race connections to
+	 every address with race_connect()
+
+	 Servers use getaddrinfo to find an appropriate socket
 	 On each result getaddrinfo returns, it creates a socket with the results, and checks
 	 to see if that is a valid socket.
-	 If it is a valid socket, it tries to connect.
+	 If it is a valid socket, it tries to bind.
 	 If either of these steps fails, it keeps trying until it has exhausted the list.
 	 If no results are good, it returns -1
 	 Otherwise, retruns 0
@@ -34,15 +258,23 @@ by both client.c and server.c should go in here
 	 @return: -1 on failure, 0 on success
  */
 int get_socket(char* host, char* port, int* s, int is_server) {
+	if(!is_server) {
+		struct candidate candidates[MAX_CANDIDATES];
+		int n = resolve_cached(host, port, candidates);
+		if(n == -1) {
+			return -1;
+		}
+		if(race_connect(candidates, n, s) != 0) {
+			printf("could not connect\n");
+			return -1;
+		}
+		return 0;
+	}
+
 	struct addrinfo hints, *res, *temp;
 	memset(&hints, 0, sizeof hints);
 	//Servers need to support ipv6, so they use AF_INET6
-	//but clients may want to use either, so they use AF_UNSPEC
-	if(is_server) {
-		hints.ai_family = AF_INET6;
-	} else {
-		hints.ai_family = AF_UNSPEC;
-	}
+	hints.ai_family = AF_INET6;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = 0;
 
@@ -61,8 +293,8 @@ int get_socket(char* host, char* port, int* s, int is_server) {
 
 	int bind_res;
 	int yes = 1;
-	for(temp = res; temp; temp = res->ai_next) {
-		*s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	for(temp = res; temp; temp = temp->ai_next) {
+		*s = socket(temp->ai_family, temp->ai_socktype, temp->ai_protocol);
 		if(*s == -1) {
 			printf("Socket error\n");
 			continue;
@@ -71,12 +303,7 @@ int get_socket(char* host, char* port, int* s, int is_server) {
 		//Allows us to reuse ports as they wait for the kernel to clear them
 		setsockopt(*s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
-		//Servers want to bind, clients want to connect
-		if(is_server) {
-			bind_res = bind(*s, res->ai_addr, res->ai_addrlen);
-		} else {
-			bind_res = connect(*s, res->ai_addr, res->ai_addrlen);
-		}
+		bind_res = bind(*s, temp->ai_addr, temp->ai_addrlen);
 		if(bind_res != 0) {
 			close(*s);
 			printf("Could not bind\n");
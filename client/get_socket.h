@@ -8,5 +8,17 @@
 #include <netdb.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+//How long a connection attempt gets before we also start on the next address
+#define CONNECT_STAGGER_MS 250
+//The most addresses we will try for one host
+#define MAX_CANDIDATES 16
+//How many hosts we remember the addresses of, and for how many seconds
+#define DNS_CACHE_SIZE 16
+#define DNS_CACHE_TTL 60
 
 int get_socket(char* host, char* port, int* s, int is_server);
@@ -0,0 +1,407 @@
+/*
+pipeline.c
+
+Pipelined request mode for the client
+Instead of sending one request and reading one response, this opens a single
+connection and keeps up to a given number of requests in flight on it. The
+responses come back to back on the same socket, so they are all parsed out of
+one buffered stream, using either the content length or the chunked encoding
+to find where each one ends.
+
+The same code can also open a fresh connection for every request, which gives
+a baseline to compare the pipelined numbers against
+*/
+#include "get_socket.h"
+#include "pipeline.h"
+#include <ctype.h>
+#include <errno.h>
+#include <sys/time.h>
+
+/*
+	 Reads more data from the socket into the stream buffer
+	 Anything that has already been consumed is moved out of the way first, so
+	 there is always room at the end of the buffer
+
+	 @param st: the stream to fill
+
+	 @return: the number of bytes read, 0 if the server closed the connection, -1 on error
+ */
+static int stream_fill(struct stream* st) {
+	if(st->start > 0) {
+		memmove(st->buf, st->buf + st->start, st->end - st->start);
+		st->end -= st->start;
+		st->start = 0;
+	}
+	if(st->end == STREAM_BUFFER_SIZE) {
+		return -1;
+	}
+	int chars_read;
+	do {
+		chars_read = recv(st->s, st->buf + st->end, STREAM_BUFFER_SIZE - st->end, 0);
+	} while(chars_read == -1 && errno == EINTR);
+	if(chars_read > 0) {
+		st->end += chars_read;
+	}
+	return chars_read;
+}
+
+/*
+	 Gets one \r\n terminated line out of the stream, without the line ending
+
+	 @param st: the stream to read from
+	 @param line: where the line is copied to, it is always null terminated
+	 @param max: the size of line
+
+	 @return: the length of the line, or -1 if the connection ended or the line was too long
+ */
+static int stream_read_line(struct stream* st, char* line, int max) {
+	while(1) {
+		char* newline = memchr(st->buf + st->start, '\n', st->end - st->start);
+		if(newline) {
+			char* begin = st->buf + st->start;
+			int len = newline - begin;
+			st->start += len + 1;
+			if(len > 0 && begin[len-1] == '\r') {
+				--len;
+			}
+			if(len >= max) {
+				return -1;
+			}
+			memcpy(line, begin, len);
+			line[len] = '\0';
+			return len;
+		}
+		if(st->end - st->start >= MAX_LINE_LEN || stream_fill(st) <= 0) {
+			return -1;
+		}
+	}
+}
+
+/*
+	 Throws away the next n bytes of the stream, this is what happens to the body
+	 of every response, since we only care about how long it took to arrive
+
+	 @param st: the stream to read from
+	 @param n: how many bytes to skip
+
+	 @return: 0 on success, -1 if the connection ended first
+ */
+static int stream_discard(struct stream* st, long n) {
+	while(n > 0) {
+		if(st->start == st->end && stream_fill(st) <= 0) {
+			return -1;
+		}
+		long available = st->end - st->start;
+		long take = available < n ? available : n;
+		st->start += take;
+		n -= take;
+	}
+	return 0;
+}
+
+/*
+	 Reads a chunked body off the stream, including any trailer fields after the
+	 last chunk
+
+	 @param st: the stream to read from
+	 @param body_len: filled with the number of body bytes, not counting the chunk framing
+
+	 @return: 0 on success, -1 on a malformed body or a closed connection
+ */
+static int read_chunked(struct stream* st, long* body_len) {
+	char line[MAX_LINE_LEN];
+	long chunk_size;
+	char* end;
+	*body_len = 0;
+	while(1) {
+		if(stream_read_line(st, line, sizeof(line)) == -1) {
+			return -1;
+		}
+		//chunk extensions come after a ';', and we ignore them
+		chunk_size = strtol(line, &end, 16);
+		if(end == line || chunk_size < 0) {
+			printf("Chunked webpage was malformed\n");
+			return -1;
+		}
+		if(chunk_size == 0) {
+			break;
+		}
+		if(stream_discard(st, chunk_size) == -1) {
+			return -1;
+		}
+		*body_len += chunk_size;
+		//takes care of trailing \r\n before the next hex value
+		if(stream_read_line(st, line, sizeof(line)) != 0) {
+			printf("Chunked webpage was malformed\n");
+			return -1;
+		}
+	}
+	//The last chunk is followed by optional trailers, then an empty line
+	do {
+		if(stream_read_line(st, line, sizeof(line)) == -1) {
+			return -1;
+		}
+	} while(line[0] != '\0');
+	return 0;
+}
+
+/*
+	 Reads one whole response off the stream, the status line, the header, and the body
+	 Interim 1xx responses are skipped over. The body is empty for 1xx, 204 and 304
+	 responses, is framed by the chunked encoding if that is used, then by
+	 Content-Length if it is given, and otherwise runs until the server closes the connection
+
+	 @param st: the stream to read from
+	 @param r: the status, body length, and whether the server will close are filled in here
+
+	 @return: 0 on success, 1 if the server closed the connection before the response
+		 started, -1 on failure
+ */
+static int read_response(struct stream* st, struct response* r) {
+	char line[MAX_LINE_LEN];
+	long content_length;
+	int chunked;
+
+	//A server that has had enough of this connection hangs up between responses
+	if(st->start == st->end) {
+		int chars_read = stream_fill(st);
+		if(chars_read == 0 || (chars_read == -1 && (errno == ECONNRESET || errno == EPIPE))) {
+			return 1;
+		}
+		if(chars_read == -1) {
+			printf("Socket error\n");
+			return -1;
+		}
+	}
+
+	r->closes = 0;
+	do {
+		content_length = -1;
+		chunked = 0;
+		if(stream_read_line(st, line, sizeof(line)) == -1) {
+			printf("Server closed connection\n");
+			return -1;
+		}
+		if(sscanf(line, "HTTP/%*d.%*d %d", &r->status) != 1) {
+			printf("Malformed status line: %s\n", line);
+			return -1;
+		}
+
+		//Go through the header fields until the empty line that ends them
+		while(1) {
+			if(stream_read_line(st, line, sizeof(line)) == -1) {
+				printf("Server closed connection\n");
+				return -1;
+			}
+			if(line[0] == '\0') {
+				break;
+			}
+			//Header values are case insensitive too
+			for(char* c = line; *c; c++) {
+				*c = tolower((unsigned char)*c);
+			}
+			if(strncmp(line, "content-length:", 15) == 0) {
+				content_length = strtol(line + 15, NULL, 10);
+			} else if(strncmp(line, "transfer-encoding:", 18) == 0 && strstr(line + 18, "chunked")) {
+				chunked = 1;
+			} else if(strncmp(line, "connection:", 11) == 0 && strstr(line + 11, "close")) {
+				r->closes = 1;
+			}
+		}
+	} while(r->status >= 100 && r->status < 200);
+
+	if(r->status == 204 || r->status == 304) {
+		r->body_len = 0;
+		return 0;
+	}
+	if(chunked) {
+		return read_chunked(st, &r->body_len);
+	}
+	if(content_length >= 0) {
+		r->body_len = content_length;
+		return stream_discard(st, content_length);
+	}
+	//No framing at all, the body is everything until the server hangs up
+	r->closes = 1;
+	r->body_len = 0;
+	while(1) {
+		r->body_len += st->end - st->start;
+		st->start = st->end;
+		int chars_read = stream_fill(st);
+		if(chars_read == 0) {
+			return 0;
+		}
+		if(chars_read == -1) {
+			return -1;
+		}
+	}
+}
+
+/*
+	 Sends all of a buffer, send() is allowed to take less than we asked it to
+	 If the server has hung up, this fails with EPIPE instead of raising SIGPIPE
+
+	 @return: 0 on success, -1 on failure
+ */
+static int send_all(int s, char* buf, int len) {
+	while(len > 0) {
+		int sent = send(s, buf, len, MSG_NOSIGNAL);
+		if(sent == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
+/*
+	 @return: the number of microseconds between the two times
+ */
+static long elapsed_us(struct timespec* start, struct timespec* end) {
+	return 1000000*(end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec)/1000;
+}
+
+/*
+	 Sends count requests to the host, and reads back all of the responses
+	 The paths are requested in turn, wrapping around when we run out of them.
+
+	 Normally everything goes down one connection, with up to depth requests sent
+	 before their responses come back. Each time a response is finished, another
+	 request is sent to keep the pipeline full.
+	 If the server closes the connection, whether it said so with Connection: close
+	 or just hung up, a new connection is made and the requests it hadn't answered
+	 are sent again. The number of reconnects is printed with the totals.
+	 If per_connection is set, a new connection is opened for every request
+	 instead, and the time to connect is counted in each request's latency
+
+	 When everything is done, a line is printed for every response, giving its
+	 status, body length, and the time from sending the request to having its
+	 whole response. Then the totals are printed.
+
+	 @param host: the hostname e.g. "www.cnn.com"
+	 @param port: the port we want to connect on e.g. "80"
+	 @param paths: the files to request, without the leading /
+	 @param num_paths: how many paths there are
+	 @param count: how many requests to send in total
+	 @param depth: the most requests that may be waiting on a response at once
+	 @param per_connection: if nonzero, use one connection per request
+
+	 @return: 0 on success, -1 on failure
+ */
+int run_pipeline(char* host, char* port, char** paths, int num_paths, int count, int depth, int per_connection) {
+	struct response* responses = calloc(count, sizeof(*responses));
+	struct stream* st = malloc(sizeof(*st));
+	struct timespec t_start, t_end, t_conn;
+	int s = -1;
+	int sent = 0;
+	int done = 0;
+	int result = 0;
+	int connections = 0;
+	//how many responses had been read when the current connection was made
+	int done_at_connect = 0;
+
+	if(per_connection) {
+		depth = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	while(done < count) {
+		if(s == -1) {
+			clock_gettime(CLOCK_MONOTONIC, &t_conn);
+			if(get_socket(host, port, &s, 0) != 0) {
+				result = -1;
+				break;
+			}
+			//A server that loses one of our requests would otherwise leave us waiting forever
+			struct timeval timeout = { PIPELINE_TIMEOUT, 0 };
+			setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+			st->s = s;
+			st->start = 0;
+			st->end = 0;
+			++connections;
+			done_at_connect = done;
+		}
+
+		//Top the pipeline back up
+		while(sent < count && sent - done < depth) {
+			struct response* r = &responses[sent];
+			r->path = paths[sent % num_paths];
+			//The last request on a connection tells the server it can hang up
+			char* connection = (per_connection || sent == count - 1) ? "close" : "keep-alive";
+			char request[100 + strlen(host) + strlen(r->path)];
+			int len = sprintf(request, "GET /%s HTTP/1.1\r\nHost: %s\r\nUser-Agent: curl/1.0\r\nConnection: %s\r\n\r\n", r->path, host, connection);
+			if(per_connection) {
+				r->t_sent = t_conn;
+			} else {
+				clock_gettime(CLOCK_MONOTONIC, &r->t_sent);
+			}
+			//If the server has hung up, the answers it did send may still be waiting to be read
+			if(send_all(s, request, len) == -1) {
+				if(errno != EPIPE && errno != ECONNRESET) {
+					printf("Socket error\n");
+					result = -1;
+				}
+				break;
+			}
+			++sent;
+		}
+		if(result == -1) {
+			break;
+		}
+
+		int closed = read_response(st, &responses[done]);
+		if(closed == -1) {
+			printf("Response %d could not be read\n", done);
+			result = -1;
+			break;
+		}
+		if(closed) {
+			//Without a single answer, another connection would only go the same way
+			if(done == done_at_connect) {
+				printf("Server closed the connection without answering\n");
+				result = -1;
+				break;
+			}
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &responses[done].t_done);
+			++done;
+		}
+
+		//Whatever was sent after the last answer has to go again on a new connection
+		if(closed || per_connection || responses[done-1].closes) {
+			close(s);
+			s = -1;
+			sent = done;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+	if(s != -1) {
+		close(s);
+	}
+
+	long total_latency = 0;
+	for(int i = 0; i < done; i++) {
+		long latency = elapsed_us(&responses[i].t_sent, &responses[i].t_done);
+		total_latency += latency;
+		printf("%d\t%d\t%ld bytes\t%ld us\t/%s\n", i, responses[i].status, responses[i].body_len, latency, responses[i].path);
+	}
+	long total = elapsed_us(&t_start, &t_end);
+	printf("\n%d of %d responses in %ld microseconds", done, count, total);
+	if(per_connection) {
+		printf(" (one connection per request)\n");
+	} else {
+		printf(" (pipeline depth %d, %d reconnects)\n", depth, connections > 0 ? connections - 1 : 0);
+	}
+	if(done > 0) {
+		printf("Mean latency: %ld microseconds\n", total_latency / done);
+		printf("Per request: %ld microseconds\n", total / done);
+	}
+
+	free(st);
+	free(responses);
+	return result;
+}
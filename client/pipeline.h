@@ -0,0 +1,29 @@
+#include <time.h>
+
+//How much of the connection we buffer at once, responses are parsed out of this
+#define STREAM_BUFFER_SIZE 0x1000
+//The longest header line we are willing to accept from the server
+#define MAX_LINE_LEN 0x400
+//How many seconds we wait on a stalled pipeline before giving up on it
+#define PIPELINE_TIMEOUT 5
+
+//A buffered view of a socket, shared by every response that comes back on it
+struct stream {
+	int s;
+	char buf[STREAM_BUFFER_SIZE];
+	int start;
+	int end;
+};
+
+//What we learned about one response, and when its request went out
+struct response {
+	char* path;
+	int status;
+	long body_len;
+	//set if the server said it will close the connection after this response
+	int closes;
+	struct timespec t_sent;
+	struct timespec t_done;
+};
+
+int run_pipeline(char* host, char* port, char** paths, int num_paths, int count, int depth, int per_connection);
@@ -0,0 +1,573 @@
+/*
+	 autoindex.c
+
+Generated listings for directories that have no index.html
+Listings come in HTML, or JSON with ?format=json, and can be split into pages
+with ?page=N and ?per_page=N
+
+Directories can hold tens of thousands of files, so each one is only read once.
+Every entry keeps its row of the listing already serialized, and the whole
+listing is kept too. Instead of reading the directory again, an inotify watch
+tells us which entries changed, and only those get stat()ed and serialized again
+ */
+
+#include "get_socket.h"
+#include "handle_connection.h"
+#include "autoindex.h"
+#include <stdarg.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/inotify.h>
+
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+int autoindex_enabled = 0;
+
+static int inotify_fd = -1;
+static struct dir_listing* listings[AUTOINDEX_MAX_DIRS];
+static unsigned long use_counter = 0;
+//Guards everything above, the handler threads all share one cache
+static pthread_mutex_t listings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//A string that grows as we append to it
+struct buffer {
+	char* data;
+	int len;
+	int capacity;
+};
+
+static void buf_append(struct buffer* b, const char* s, int n) {
+	if(b->len + n + 1 > b->capacity) {
+		while(b->len + n + 1 > b->capacity) {
+			b->capacity = b->capacity ? b->capacity * 2 : 256;
+		}
+		b->data = realloc(b->data, b->capacity);
+	}
+	memcpy(b->data + b->len, s, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
+
+static void buf_puts(struct buffer* b, const char* s) {
+	buf_append(b, s, strlen(s));
+}
+
+static void buf_printf(struct buffer* b, const char* fmt, ...) {
+	char small[256];
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(small, sizeof(small), fmt, args);
+	va_end(args);
+	if(n < (int)sizeof(small)) {
+		buf_append(b, small, n);
+		return;
+	}
+	char* big = malloc(n + 1);
+	va_start(args, fmt);
+	vsnprintf(big, n + 1, fmt, args);
+	va_end(args);
+	buf_append(b, big, n);
+	free(big);
+}
+
+static void append_html_escaped(struct buffer* b, const char* s) {
+	for(; *s; s++) {
+		switch(*s) {
+			case '&': buf_append(b, "&amp;", 5); break;
+			case '<': buf_append(b, "&lt;", 4); break;
+			case '>': buf_append(b, "&gt;", 4); break;
+			case '"': buf_append(b, "&quot;", 6); break;
+			case '\'': buf_append(b, "&#39;", 5); break;
+			default: buf_append(b, s, 1);
+		}
+	}
+}
+
+//Everything but the unreserved characters of RFC 3986, and the characters in keep, is percent encoded
+static void append_url_encoded(struct buffer* b, const char* s, const char* keep) {
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || strchr("-._~", c) || strchr(keep, c)) {
+			buf_append(b, s, 1);
+		} else {
+			buf_printf(b, "%%%02X", c);
+		}
+	}
+}
+
+static void append_json_escaped(struct buffer* b, const char* s) {
+	for(; *s; s++) {
+		unsigned char c = *s;
+		if(c == '"' || c == '\\') {
+			buf_printf(b, "\\%c", c);
+		} else if(c < 0x20) {
+			buf_printf(b, "\\u%04x", c);
+		} else {
+			buf_append(b, s, 1);
+		}
+	}
+}
+
+/*
+	 Serializes one entry into its row of the HTML table and its JSON object
+ */
+static void serialize_entry(struct dir_entry* e) {
+	struct buffer b;
+	char modified[32];
+	struct tm tm;
+	gmtime_r(&e->mtime, &tm);
+	strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+
+	memset(&b, 0, sizeof(b));
+	buf_puts(&b, "<tr><td><a href=\"");
+	append_url_encoded(&b, e->name, "");
+	buf_puts(&b, e->is_dir ? "/\">" : "\">");
+	append_html_escaped(&b, e->name);
+	if(e->is_dir) {
+		buf_printf(&b, "/</a></td><td>-</td><td>%s</td></tr>\n", modified);
+	} else {
+		buf_printf(&b, "</a></td><td>%ld</td><td>%s</td></tr>\n", e->size, modified);
+	}
+	free(e->serialized[FORMAT_HTML]);
+	e->serialized[FORMAT_HTML] = b.data;
+	e->serialized_len[FORMAT_HTML] = b.len;
+
+	memset(&b, 0, sizeof(b));
+	buf_puts(&b, "{\"name\":\"");
+	append_json_escaped(&b, e->name);
+	buf_printf(&b, "\",\"type\":\"%s\",\"size\":%ld,\"mtime\":%ld}", e->is_dir ? "dir" : "file", e->size, (long)e->mtime);
+	free(e->serialized[FORMAT_JSON]);
+	e->serialized[FORMAT_JSON] = b.data;
+	e->serialized_len[FORMAT_JSON] = b.len;
+}
+
+static void free_entry(struct dir_entry* e) {
+	free(e->name);
+	for(int f = 0; f < NUM_FORMATS; f++) {
+		free(e->serialized[f]);
+	}
+}
+
+/*
+	 The cached bodies no longer match the entries, they are rebuilt on the next request
+ */
+static void invalidate_bodies(struct dir_listing* l) {
+	for(int f = 0; f < NUM_FORMATS; f++) {
+		free(l->body[f]);
+		l->body[f] = NULL;
+	}
+}
+
+static void free_listing(struct dir_listing* l) {
+	for(int i = 0; i < l->num_entries; i++) {
+		free_entry(&l->entries[i]);
+	}
+	invalidate_bodies(l);
+	free(l->entries);
+	free(l->url_path);
+	free(l);
+}
+
+/*
+	 Finds where a name is, or would go, in a listing's sorted entries
+
+	 @param found: set to 1 if the name is already there
+	 @return: the index of the entry
+ */
+static int find_entry(struct dir_listing* l, const char* name, int* found) {
+	int low = 0, high = l->num_entries;
+	*found = 0;
+	while(low < high) {
+		int mid = (low + high) / 2;
+		int cmp = strcmp(l->entries[mid].name, name);
+		if(cmp == 0) {
+			*found = 1;
+			return mid;
+		}
+		if(cmp < 0) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	return low;
+}
+
+/*
+	 Brings one entry of a listing up to date, adding it, changing it, or taking it
+	 out if it is no longer there. Hidden files are never listed.
+	 This is for the changes inotify tells us about, build_listing() reads whole directories
+
+	 @param l: the listing
+	 @param name: the name of the file within the directory
+ */
+static void refresh_entry(struct dir_listing* l, const char* name) {
+	if(name[0] == '.') {
+		return;
+	}
+	char path[strlen(WEBROOT) + strlen(l->url_path) + strlen(name) + 1];
+	sprintf(path, "%s%s%s", WEBROOT, l->url_path, name);
+	struct stat buf;
+	int found;
+	int i = find_entry(l, name, &found);
+
+	if(stat(path, &buf) == -1) {
+		if(found) {
+			free_entry(&l->entries[i]);
+			memmove(&l->entries[i], &l->entries[i+1], (l->num_entries - i - 1) * sizeof(*l->entries));
+			--l->num_entries;
+		}
+		return;
+	}
+	if(!found) {
+		if(l->num_entries == l->capacity) {
+			l->capacity = l->capacity ? l->capacity * 2 : 64;
+			l->entries = realloc(l->entries, l->capacity * sizeof(*l->entries));
+		}
+		memmove(&l->entries[i+1], &l->entries[i], (l->num_entries - i) * sizeof(*l->entries));
+		memset(&l->entries[i], 0, sizeof(*l->entries));
+		l->entries[i].name = strdup(name);
+		++l->num_entries;
+	}
+	struct dir_entry* e = &l->entries[i];
+	e->is_dir = S_ISDIR(buf.st_mode);
+	e->size = buf.st_size;
+	e->mtime = buf.st_mtime;
+	serialize_entry(e);
+}
+
+/*
+	 Stops watching a directory and throws its listing away
+
+	 @param slot: where the listing is in listings[]
+ */
+static void drop_listing(int slot) {
+	inotify_rm_watch(inotify_fd, listings[slot]->wd);
+	free_listing(listings[slot]);
+	listings[slot] = NULL;
+}
+
+static int find_listing_by_wd(int wd) {
+	for(int i = 0; i < AUTOINDEX_MAX_DIRS; i++) {
+		if(listings[i] && listings[i]->wd == wd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+	 Reads every inotify event that has come in since we last looked, and updates
+	 the entries they name. Must be called with listings_lock held.
+ */
+static void apply_events(void) {
+	char events[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	int len;
+	while((len = read(inotify_fd, events, sizeof(events))) > 0) {
+		char* p = events;
+		while(p < events + len) {
+			struct inotify_event* ev = (struct inotify_event*)p;
+			p += sizeof(struct inotify_event) + ev->len;
+
+			//We missed events, so none of the listings can be trusted
+			if(ev->mask & IN_Q_OVERFLOW) {
+				for(int i = 0; i < AUTOINDEX_MAX_DIRS; i++) {
+					if(listings[i]) {
+						drop_listing(i);
+					}
+				}
+				continue;
+			}
+			int slot = find_listing_by_wd(ev->wd);
+			if(slot == -1) {
+				continue;
+			}
+			if(ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+				drop_listing(slot);
+			} else if(ev->len > 0) {
+				refresh_entry(listings[slot], ev->name);
+				invalidate_bodies(listings[slot]);
+			}
+		}
+	}
+}
+
+static int compare_entries(const void* a, const void* b) {
+	return strcmp(((struct dir_entry*)a)->name, ((struct dir_entry*)b)->name);
+}
+
+/*
+	 Reads a directory, and starts watching it for changes
+	 The watch is added before reading, so nothing that changes in between is missed
+
+	 @param url_path: the directory as it was requested, ending in a /
+	 @param wd: the watch descriptor returned by inotify_add_watch()
+
+	 @return: the new listing, or NULL if the directory could not be read
+ */
+static struct dir_listing* build_listing(char* url_path, int wd) {
+	char path[strlen(WEBROOT) + strlen(url_path) + 1];
+	sprintf(path, "%s%s", WEBROOT, url_path);
+	DIR* dir = opendir(path);
+	if(dir == NULL) {
+		return NULL;
+	}
+	struct dir_listing* l = calloc(1, sizeof(*l));
+	l->url_path = strdup(url_path);
+	l->wd = wd;
+	struct dirent* d;
+	struct stat buf;
+	while((d = readdir(dir)) != NULL) {
+		if(d->d_name[0] == '.' || fstatat(dirfd(dir), d->d_name, &buf, 0) == -1) {
+			continue;
+		}
+		if(l->num_entries == l->capacity) {
+			l->capacity = l->capacity ? l->capacity * 2 : 64;
+			l->entries = realloc(l->entries, l->capacity * sizeof(*l->entries));
+		}
+		struct dir_entry* e = &l->entries[l->num_entries++];
+		memset(e, 0, sizeof(*e));
+		e->name = strdup(d->d_name);
+		e->is_dir = S_ISDIR(buf.st_mode);
+		e->size = buf.st_size;
+		e->mtime = buf.st_mtime;
+	}
+	closedir(dir);
+
+	//Sorting once is much cheaper than inserting every entry in order
+	qsort(l->entries, l->num_entries, sizeof(*l->entries), compare_entries);
+	for(int i = 0; i < l->num_entries; i++) {
+		serialize_entry(&l->entries[i]);
+	}
+	return l;
+}
+
+/*
+	 Finds the listing for a directory, building it if we don't have it yet
+	 Must be called with listings_lock held.
+
+	 @param url_path: the directory as it was requested, ending in a /
+	 @return: the listing, or NULL if the directory could not be listed
+ */
+static struct dir_listing* get_listing(char* url_path) {
+	int free_slot = -1;
+	int lru = 0;
+	for(int i = 0; i < AUTOINDEX_MAX_DIRS; i++) {
+		if(listings[i] == NULL) {
+			free_slot = i;
+		} else if(strcmp(listings[i]->url_path, url_path) == 0) {
+			listings[i]->last_used = ++use_counter;
+			return listings[i];
+		} else if(listings[lru] && listings[i]->last_used < listings[lru]->last_used) {
+			lru = i;
+		}
+	}
+
+	char path[strlen(WEBROOT) + strlen(url_path) + 1];
+	sprintf(path, "%s%s", WEBROOT, url_path);
+	int wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+	if(wd == -1) {
+		return NULL;
+	}
+	//Another spelling of a directory we already watch, e.g. /a/./ and /a/
+	int slot = find_listing_by_wd(wd);
+	if(slot != -1) {
+		listings[slot]->last_used = ++use_counter;
+		return listings[slot];
+	}
+
+	if(free_slot == -1) {
+		drop_listing(lru);
+		free_slot = lru;
+	}
+	struct dir_listing* l = build_listing(url_path, wd);
+	if(l == NULL) {
+		inotify_rm_watch(inotify_fd, wd);
+		return NULL;
+	}
+	l->last_used = ++use_counter;
+	listings[free_slot] = l;
+	return l;
+}
+
+/*
+	 Serializes part of a listing
+
+	 @param l: the listing
+	 @param format: FORMAT_HTML or FORMAT_JSON
+	 @param page: which page, counting from 1
+	 @param per_page: how many entries on a page, 0 means everything on one page
+
+	 @return: the body, its length is in b->len
+ */
+static struct buffer render(struct dir_listing* l, int format, int page, int per_page) {
+	struct buffer b;
+	memset(&b, 0, sizeof(b));
+	int first = 0;
+	int last = l->num_entries;
+	int pages = 1;
+	if(per_page > 0) {
+		pages = l->num_entries ? (l->num_entries + per_page - 1) / per_page : 1;
+		//Pages past the end show the last page, which also keeps first inside the entries
+		page = page < pages ? page : pages;
+		first = (page - 1) * per_page;
+		last = per_page < l->num_entries - first ? first + per_page : l->num_entries;
+	}
+
+	if(format == FORMAT_JSON) {
+		buf_puts(&b, "{\"path\":\"");
+		append_json_escaped(&b, l->url_path);
+		buf_printf(&b, "\",\"total\":%d,\"page\":%d,\"pages\":%d,\"entries\":[", l->num_entries, page, pages);
+		for(int i = first; i < last; i++) {
+			if(i > first) {
+				buf_puts(&b, ",");
+			}
+			buf_append(&b, l->entries[i].serialized[FORMAT_JSON], l->entries[i].serialized_len[FORMAT_JSON]);
+		}
+		buf_puts(&b, "]}\n");
+		return b;
+	}
+
+	buf_puts(&b, "<!DOCTYPE html>\n<html>\n<head><meta charset=\"utf-8\"><title>Index of ");
+	append_html_escaped(&b, l->url_path);
+	buf_puts(&b, "</title></head>\n<body>\n<h1>Index of ");
+	append_html_escaped(&b, l->url_path);
+	buf_puts(&b, "</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Modified (UTC)</th></tr>\n");
+	if(strcmp(l->url_path, "/") != 0) {
+		buf_puts(&b, "<tr><td><a href=\"../\">../</a></td><td>-</td><td></td></tr>\n");
+	}
+	for(int i = first; i < last; i++) {
+		buf_append(&b, l->entries[i].serialized[FORMAT_HTML], l->entries[i].serialized_len[FORMAT_HTML]);
+	}
+	buf_puts(&b, "</table>\n");
+	if(per_page > 0) {
+		buf_puts(&b, "<p>");
+		if(page > 1) {
+			buf_printf(&b, "<a href=\"?page=%d&amp;per_page=%d\">Previous</a> ", page - 1, per_page);
+		}
+		buf_printf(&b, "Page %d of %d", page, pages);
+		if(page < pages) {
+			buf_printf(&b, " <a href=\"?page=%d&amp;per_page=%d\">Next</a>", page + 1, per_page);
+		}
+		buf_puts(&b, "</p>\n");
+	}
+	buf_puts(&b, "</body>\n</html>\n");
+	return b;
+}
+
+/*
+	 Starts up the inotify instance used to keep listings up to date
+
+	 @return: 0 on success, -1 on failure
+ */
+int autoindex_init(void) {
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(inotify_fd == -1) {
+		printf("Could not start inotify\n");
+		return -1;
+	}
+	autoindex_enabled = 1;
+	return 0;
+}
+
+/*
+	 Sends a listing of a directory under WEBROOT
+	 The cached listing is used if it is still good, otherwise only the entries that
+	 have changed since it was built are updated. A directory requested without
+	 the trailing / is redirected to it, so the relative links in the listing work.
+
+	 The query string may contain:
+		format=json   send JSON instead of HTML
+		page=N        send only the Nth page of entries, counting from 1
+		per_page=N    how many entries go on a page, up to AUTOINDEX_MAX_PER_PAGE
+
+	 @param con_sock: the socket
+	 @param url_path: the requested directory, already percent decoded, e.g. "/builds/"
+	 @param query: everything after the ? in the request, or NULL
+
+	 @return: 0 if a reply was sent, -1 if the path is not a directory we can list
+ */
+int send_autoindex(int con_sock, char* url_path, char* query) {
+	int format = FORMAT_HTML;
+	int page = 1;
+	int per_page = 0;
+	char* saveptr;
+	char* param;
+	char query_copy[query ? strlen(query) + 1 : 1];
+	strcpy(query_copy, query ? query : "");
+	for(param = strtok_r(query_copy, "&", &saveptr); param; param = strtok_r(NULL, "&", &saveptr)) {
+		if(strcmp(param, "format=json") == 0) {
+			format = FORMAT_JSON;
+		} else if(strncmp(param, "page=", 5) == 0) {
+			page = atoi(param + 5);
+			per_page = per_page ? per_page : AUTOINDEX_PER_PAGE;
+		} else if(strncmp(param, "per_page=", 9) == 0) {
+			per_page = atoi(param + 9);
+		}
+	}
+	page = page < 1 ? 1 : page;
+	per_page = per_page < 0 ? 0 : per_page > AUTOINDEX_MAX_PER_PAGE ? AUTOINDEX_MAX_PER_PAGE : per_page;
+
+	//Repeated slashes would give the same directory a second listing
+	char key[strlen(url_path) + 2];
+	int len = 0;
+	for(char* c = url_path; *c; c++) {
+		if(*c != '/' || len == 0 || key[len-1] != '/') {
+			key[len++] = *c;
+		}
+	}
+	key[len] = '\0';
+
+	if(len == 0) {
+		return -1;
+	}
+	if(key[len-1] != '/') {
+		char path[strlen(WEBROOT) + len + 1];
+		struct stat buf;
+		sprintf(path, "%s%s", WEBROOT, key);
+		if(stat(path, &buf) == -1 || !S_ISDIR(buf.st_mode)) {
+			return -1;
+		}
+		//The key has been decoded, so it is encoded again for the Location
+		struct buffer header;
+		memset(&header, 0, sizeof(header));
+		buf_puts(&header, "HTTP/1.1 301 Moved Permanently\r\nLocation: ");
+		append_url_encoded(&header, key, "/");
+		buf_printf(&header, "/%s%s\r\nContent-Length: 0\r\n\r\n", query ? "?" : "", query ? query : "");
+		send(con_sock, header.data, header.len, 0);
+		free(header.data);
+		return 0;
+	}
+
+	pthread_mutex_lock(&listings_lock);
+	apply_events();
+	struct dir_listing* l = get_listing(key);
+	if(l == NULL) {
+		pthread_mutex_unlock(&listings_lock);
+		return -1;
+	}
+
+	//Copy the body out, so we can send it without holding the lock
+	struct buffer body;
+	if(per_page == 0) {
+		if(l->body[format] == NULL) {
+			body = render(l, format, 1, 0);
+			l->body[format] = body.data;
+			l->body_len[format] = body.len;
+		}
+		body.len = l->body_len[format];
+		body.data = malloc(body.len);
+		memcpy(body.data, l->body[format], body.len);
+	} else {
+		body = render(l, format, page, per_page);
+	}
+	pthread_mutex_unlock(&listings_lock);
+
+	char header[200];
+	sprintf(header, "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+			format == FORMAT_JSON ? "application/json" : "text/html; charset=utf-8", body.len);
+	send(con_sock, header, strlen(header), 0);
+	send_all(con_sock, body.data, body.len);
+	free(body.data);
+	return 0;
+}
@@ -0,0 +1,42 @@
+#include <time.h>
+
+//How many directories we keep listings of at once, the least recently used goes first
+#define AUTOINDEX_MAX_DIRS 64
+//The most entries one page of a listing can ask for with ?per_page=
+#define AUTOINDEX_MAX_PER_PAGE 10000
+//How many entries a page gets if ?page= is given without ?per_page=
+#define AUTOINDEX_PER_PAGE 1000
+
+enum autoindex_format {
+	FORMAT_HTML,
+	FORMAT_JSON,
+	NUM_FORMATS
+};
+
+//One file in a directory, along with its row of the listing, already serialized
+struct dir_entry {
+	char* name;
+	int is_dir;
+	long size;
+	time_t mtime;
+	char* serialized[NUM_FORMATS];
+	int serialized_len[NUM_FORMATS];
+};
+
+//A directory we have listed, kept up to date with inotify
+struct dir_listing {
+	char* url_path;
+	int wd;
+	struct dir_entry* entries;
+	int num_entries;
+	int capacity;
+	//The whole listing, unpaginated, or NULL if it has changed since it was last built
+	char* body[NUM_FORMATS];
+	int body_len[NUM_FORMATS];
+	unsigned long last_used;
+};
+
+extern int autoindex_enabled;
+
+int autoindex_init(void);
+int send_autoindex(int con_sock, char* url_path, char* query);
@@ -0,0 +1,194 @@
+/*
+	 content_cache.c
+
+Static files kept in memory, with a separate cache for every NUMA node
+Each reply is stored whole, header and body, in memory from node_alloc(), so a
+worker pinned to a node sends from its own node's memory instead of reaching
+across to whichever node first read the file. Entries are checked against the
+file's stat() on every hit, so a changed file is read again.
+ */
+
+#include "get_socket.h"
+#include "handle_connection.h"
+#include "content_cache.h"
+#include "numa.h"
+
+struct node_cache {
+	pthread_mutex_t lock;
+	struct cached_file files[CONTENT_CACHE_FILES];
+	size_t bytes;
+	unsigned long use_counter;
+};
+
+static struct node_cache* caches[MAX_NODES];
+
+/*
+	 Sets up an empty cache on every node, the caches themselves live on their node too
+
+	 @param num_nodes: how many nodes there are
+	 @return: 0 on success, -1 on failure
+ */
+int content_cache_init(int num_nodes) {
+	for(int node = 0; node < num_nodes; node++) {
+		caches[node] = node_alloc(sizeof(struct node_cache), node);
+		if(caches[node] == NULL) {
+			printf("Could not allocate the cache for node %d\n", node);
+			return -1;
+		}
+		memset(caches[node], 0, sizeof(struct node_cache));
+		pthread_mutex_init(&caches[node]->lock, NULL);
+	}
+	return 0;
+}
+
+/*
+	 Drops one reference to a response, freeing it if nobody is using it any more
+	 Must be called with the cache's lock held
+ */
+static void release(struct cached_response* r) {
+	if(--r->refs == 0) {
+		node_free(r, r->mapped);
+	}
+}
+
+/*
+	 Takes a file out of a cache. Anyone still sending it keeps their copy until they are done.
+	 Must be called with the cache's lock held
+ */
+static void evict(struct node_cache* c, struct cached_file* f) {
+	c->bytes -= f->response->mapped;
+	release(f->response);
+	free(f->path);
+	memset(f, 0, sizeof(*f));
+}
+
+/*
+	 Reads a file into a new reply on a node
+	 The reply is exactly what send_reply() would have sent for the file
+
+	 @return: the reply, holding one reference, or NULL on failure
+ */
+static struct cached_response* load(int node, int fd, struct stat* st) {
+	char header[200];
+	int content_length = st->st_size + 1;
+	int header_len = sprintf(header, OK_HEADER, content_length);
+	size_t mapped = sizeof(struct cached_response) + header_len + content_length;
+
+	struct cached_response* r = node_alloc(mapped, node);
+	if(r == NULL) {
+		return NULL;
+	}
+	r->data = (char*)(r + 1);
+	r->len = header_len + content_length;
+	r->mapped = mapped;
+	r->refs = 1;
+	memcpy(r->data, header, header_len);
+	//The byte after the file is the same null byte send_reply() sends
+	char* body = r->data + header_len;
+	body[st->st_size] = '\0';
+	off_t done = 0;
+	while(done < st->st_size) {
+		ssize_t chars_read = pread(fd, body + done, st->st_size - done, done);
+		if(chars_read <= 0) {
+			node_free(r, mapped);
+			return NULL;
+		}
+		done += chars_read;
+	}
+	return r;
+}
+
+static int same_file(struct cached_file* f, struct stat* st) {
+	return f->dev == st->st_dev && f->ino == st->st_ino && f->size == st->st_size
+		&& f->mtime.tv_sec == st->st_mtim.tv_sec && f->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+	 Sends a file from a node's cache, reading it into the cache first if it isn't
+	 there or has changed. When the cache is full, the least recently used files
+	 make room.
+
+	 @param node: the node the calling thread runs on
+	 @param con_sock: the socket
+	 @param path: the file's path, this is what the cache is keyed on
+	 @param fd: the open file
+	 @param st: the file's fstat() results
+
+	 @return: 0 if the reply was sent, -1 if the file can't be cached and the caller should send it
+ */
+int content_cache_send(int node, int con_sock, char* path, int fd, struct stat* st) {
+	struct node_cache* c = caches[node];
+	struct cached_response* r = NULL;
+	if(st->st_size + 1 > CONTENT_CACHE_MAX_FILE) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&c->lock);
+	for(int i = 0; i < CONTENT_CACHE_FILES; i++) {
+		struct cached_file* f = &c->files[i];
+		if(f->path && strcmp(f->path, path) == 0) {
+			if(same_file(f, st)) {
+				r = f->response;
+				++r->refs;
+				f->last_used = ++c->use_counter;
+			} else {
+				evict(c, f);
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+
+	//A miss, read the file without holding up the other threads on this node
+	if(r == NULL) {
+		r = load(node, fd, st);
+		if(r == NULL) {
+			return -1;
+		}
+		pthread_mutex_lock(&c->lock);
+		struct cached_file* slot = NULL;
+		while(1) {
+			struct cached_file* lru = NULL;
+			slot = NULL;
+			for(int i = 0; i < CONTENT_CACHE_FILES; i++) {
+				struct cached_file* f = &c->files[i];
+				if(f->path == NULL) {
+					slot = slot ? slot : f;
+				} else if(strcmp(f->path, path) == 0) {
+					//Another thread got here first, ours replaces it
+					evict(c, f);
+					slot = slot ? slot : f;
+				} else if(lru == NULL || f->last_used < lru->last_used) {
+					lru = f;
+				}
+			}
+			if(slot && c->bytes + r->mapped <= CONTENT_CACHE_BYTES) {
+				break;
+			}
+			if(lru == NULL) {
+				slot = NULL;
+				break;
+			}
+			evict(c, lru);
+		}
+		if(slot) {
+			slot->path = strdup(path);
+			slot->dev = st->st_dev;
+			slot->ino = st->st_ino;
+			slot->size = st->st_size;
+			slot->mtime = st->st_mtim;
+			slot->response = r;
+			slot->last_used = ++c->use_counter;
+			c->bytes += r->mapped;
+			++r->refs;
+		}
+		pthread_mutex_unlock(&c->lock);
+	}
+
+	send_all(con_sock, r->data, r->len);
+
+	pthread_mutex_lock(&c->lock);
+	release(r);
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+}
@@ -0,0 +1,30 @@
+#include <sys/stat.h>
+
+//How many files each node keeps
+#define CONTENT_CACHE_FILES 256
+//Files bigger than this are always read from disk
+#define CONTENT_CACHE_MAX_FILE (1 << 20)
+//The most memory each node's cache may use
+#define CONTENT_CACHE_BYTES (64 << 20)
+
+//A whole reply, header and body, in one node's memory
+struct cached_response {
+	char* data;
+	size_t len;
+	size_t mapped;
+	//how many senders are using it, it is freed when this drops to 0
+	int refs;
+};
+
+struct cached_file {
+	char* path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct cached_response* response;
+	unsigned long last_used;
+};
+
+int content_cache_init(int num_nodes);
+int content_cache_send(int node, int con_sock, char* path, int fd, struct stat* st);
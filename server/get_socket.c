@@ -24,10 +24,12 @@ Date: 18-9-2014
 	 @param host: the hostname e.g. "www.cnn.com" or NULL
 	 @param port: the port we want to connect on e.g. "80"
 	 @param s: where we put the socket we successfully connect to
+	 @param reuse_port: if nonzero, other sockets may bind to the same port, so they can
+		 share its connections
 
 	 @return: -1 on failure, 0 on success
  */
-int get_socket(char* host, char* port, int* s) {
+int get_socket(char* host, char* port, int* s, int reuse_port) {
 	struct addrinfo hints, *res, *temp;
 	memset(&hints, 0, sizeof hints);
 	//Servers need to support ipv6, so they use AF_INET6
@@ -60,6 +62,9 @@ int get_socket(char* host, char* port, int* s) {
 
 		//Allows us to reuse ports as they wait for the kernel to clear them
 		setsockopt(*s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
+		if(reuse_port) {
+			setsockopt(*s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+		}
 
 		//Servers want to bind, clients want to connect
 		bind_res = bind(*s, res->ai_addr, res->ai_addrlen);
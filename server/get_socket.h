@@ -9,4 +9,4 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-int get_socket(char* host, char* port, int* s );
+int get_socket(char* host, char* port, int* s, int reuse_port);
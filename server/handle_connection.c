@@ -1,10 +1,42 @@
 #include "get_socket.h"
 #include "handle_connection.h"
+#include "autoindex.h"
+#include "content_cache.h"
+#include <errno.h>
+#include <ctype.h>
+/*
+	 Decodes the %XX escapes in a url, in place
+	 A %00 would cut the path short wherever it is used, so it is refused
+
+	 @param s: the url, e.g. "/my%20file.txt"
+
+	 @return: 0 on success, -1 if the url decodes to a null byte
+ */
+int url_decode(char* s) {
+	char* out = s;
+	unsigned int c;
+	for(; *s; s++) {
+		if(*s == '%' && isxdigit((unsigned char)s[1]) && isxdigit((unsigned char)s[2])) {
+			sscanf(s + 1, "%2x", &c);
+			if(c == 0) {
+				return -1;
+			}
+			*out++ = c;
+			s += 2;
+		} else {
+			*out++ = *s;
+		}
+	}
+	*out = '\0';
+	return 0;
+}
+
 /*
 	 Given a http request, this method will fill a request struct with the data contained
 
 	 The method parses the first line to obtain the Method, requested file, and HTTP version
 	 if not all of these are present, it returns an error
+	 The file must start with a /, and has its %XX escapes decoded, anything after a ? goes in query
 	 If any of these fields are malformed this method does not report the error, but relies on the calling method
 
 	 @param request: the string representing the http request
@@ -22,10 +54,15 @@ int parse_request(char* request, struct request *r) {
 	r->method = strtok_r(line, " ", &saveptr_top);
 	r->file = strtok_r(NULL, " ", &saveptr_top);
 	r->version = strtok_r(NULL, " ", &saveptr_top);
+	r->query = NULL;
+	if(r->file && (r->query = strchr(r->file, '?'))) {
+		*r->query = '\0';
+		++r->query;
+	}
 	if(r->method) {
 		//For now, we only understand GET, everything else is unparsable
 		if(strcmp(r->method, "GET") == 0) {
-			if(r->file) {
+			if(r->file && r->file[0] == '/' && url_decode(r->file) == 0) {
 				if(r->version) {
 					line = strtok_r(NULL, "\r\n", &saveptr_main);
 					while(line) {
@@ -46,13 +83,16 @@ int parse_request(char* request, struct request *r) {
 	 returns a 400 Code, if the requested file is not present, it returns 404. If the HTTP
 	 version is greater than 1.1, returns 505
 	 If everything is OK, it returns a 200, followed by the file requested
+	 A directory with no index.html gets a listing from send_autoindex(), if the
+	 server was started with -a
 
 
 	 @param con_sock: the socket
 	 @param request
+	 @param node: the NUMA node whose cache files are sent from, or -1 to read them from disk
 	 @return: -1 on request, 0 on error
  */
-int send_reply(int con_sock, char* request) {
+int send_reply(int con_sock, char* request, int node) {
 	struct request r;
 	int content_length;
 	double version;
@@ -76,20 +116,32 @@ int send_reply(int con_sock, char* request) {
 
 
 		int fd = open(file, 0);
+		//fstat finds out how big the file is, and whether it is really a directory
+		struct stat buf;
+		if(fd != -1 && (fstat(fd, &buf) == -1 || S_ISDIR(buf.st_mode))) {
+			close(fd);
+			fd = -1;
+		}
 		//Could not find the file, or they requested to go up a directory
 		// which we don't want them to do, return a 404
 		if(fd == -1 || strstr(file, "..")) {
+			if(fd != -1) {
+				close(fd);
+			} else if(autoindex_enabled && !strstr(file, "..") && send_autoindex(con_sock, r.file, r.query) == 0) {
+				return 0;
+			}
 			char* header = "HTTP/1.1 404 File Not Found\r\nContent-Length: 13\r\n\r\n404 Not Found";
 			send(con_sock,  header, strlen(header), 0);
 			return 0;
 		}
 
-		//fstat finds out how big the file is
-		struct stat buf;
-		fstat(fd, &buf);
+		if(node != -1 && content_cache_send(node, con_sock, file, fd, &buf) == 0) {
+			close(fd);
+			return 0;
+		}
 		content_length = buf.st_size+1;
 		char header[200];
-		sprintf(header, "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n", content_length);
+		sprintf(header, OK_HEADER, content_length);
 		send(con_sock, header, strlen(header), 0);
 		char body[content_length];
 		memset(&body, 0, sizeof(body));
@@ -102,6 +154,26 @@ int send_reply(int con_sock, char* request) {
 
 
 
+/*
+	 Sends all of a buffer, send() is allowed to take less than we asked it to
+
+	 @return: 0 on success, -1 on failure
+ */
+int send_all(int con_sock, char* buf, size_t len) {
+	while(len > 0) {
+		ssize_t sent = send(con_sock, buf, len, 0);
+		if(sent == -1) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf += sent;
+		len -= sent;
+	}
+	return 0;
+}
+
 /*
 	 When a socket connects, this function takes the socket, receives the http request, 
 	 and sends an appropriate reply, using the send_reply() method
@@ -144,7 +216,7 @@ void* handle_connection(void* con_attrs) {
 			//Got the end of a message, need to do a few things
 			//1) send a reply
 			//2) flush the msg buffer
-			send_reply(con_sock, msg);
+			send_reply(con_sock, msg, just_connected->node);
 			len = 0;
 			memset(msg, 0, msg_size);
 		}
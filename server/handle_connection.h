@@ -2,6 +2,8 @@
 #define BACKLOG 10
 #define MSG_MAX_LEN 0x100
 #define WEBROOT "./srv"
+//The header of every file we send, it takes the content length
+#define OK_HEADER "HTTP/1.1 200 OK\r\nContent-Length: %d\r\nConnection: close\r\n\r\n"
 
 //This can be further filled with more header data, if necesary
 // Example, if we wanted to add a place to put the user agent string, it would be here
@@ -9,12 +11,17 @@ struct request {
 	char* method;
 	char* file;
 	char* version;
+	//everything after the ? in the requested file, or NULL
+	char* query;
 	//char* user_agent;
 };
 
 struct server_thread_attr {
 	int socket;
 	int is_running;
+	//the NUMA node the thread is pinned to, or -1 if it isn't
+	int node;
 };
 
 void* handle_connection(void* con_attrs);
+int send_all(int con_sock, char* buf, size_t len);
@@ -0,0 +1,273 @@
+/*
+	 numa.c
+
+Finds out how the machine's CPUs are laid out, and keeps work and memory on
+the same node
+The layout is read from sysfs, so nothing beyond the kernel is needed. On
+machines with only one node, or kernels without NUMA, everything simply ends
+up on node 0
+ */
+
+#define _GNU_SOURCE
+#include "get_socket.h"
+#include "numa.h"
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <linux/filter.h>
+
+struct topology topo;
+
+/*
+	 Reads a sysfs list like "0-3,8-11" into an array of numbers
+
+	 @param path: the file to read
+	 @param list: filled with the numbers in the list
+	 @param max: numbers from max up are left out, list must have room for max numbers
+
+	 @return: how many numbers were read, or -1 if the file could not be read
+ */
+static int read_list(char* path, int* list, int max) {
+	FILE* f = fopen(path, "r");
+	if(f == NULL) {
+		return -1;
+	}
+	char line[4096];
+	if(fgets(line, sizeof(line), f) == NULL) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+
+	int n = 0;
+	char *saveptr, *token;
+	for(token = strtok_r(line, ",\n", &saveptr); token; token = strtok_r(NULL, ",\n", &saveptr)) {
+		int low, high;
+		int fields = sscanf(token, "%d-%d", &low, &high);
+		if(fields < 1) {
+			continue;
+		}
+		if(fields == 1) {
+			high = low;
+		}
+		for(int i = low; i <= high && i < max; i++) {
+			list[n++] = i;
+		}
+	}
+	return n;
+}
+
+/*
+	 Fills in topo from /sys/devices/system
+	 First the online CPUs we are allowed to run on are found, then which node each
+	 of them is on. Then one
+	 CPU is picked from every physical core, so hyperthreads of the same core don't
+	 get two workers, and the cores are interleaved across the nodes so that any
+	 number of workers is spread evenly over them
+
+	 @return: 0 on success, -1 on failure, including when a node has no CPU we may use
+ */
+int discover_topology(void) {
+	int cpus[MAX_CPUS];
+	int ids[MAX_NODES];
+	char path[128];
+	memset(&topo, 0, sizeof(topo));
+	for(int i = 0; i < MAX_CPUS; i++) {
+		topo.cpu_node[i] = -1;
+	}
+
+	int num_cpus = read_list("/sys/devices/system/cpu/online", cpus, MAX_CPUS);
+	if(num_cpus <= 0) {
+		printf("Could not read the online CPUs\n");
+		return -1;
+	}
+
+	//Kernels built without NUMA have no node directory, so everything is node 0
+	int num_ids = read_list("/sys/devices/system/node/online", ids, MAX_NODES);
+	for(int i = 0; i < num_ids; i++) {
+		int node_cpus[MAX_CPUS];
+		sprintf(path, "/sys/devices/system/node/node%d/cpulist", ids[i]);
+		int n = read_list(path, node_cpus, MAX_CPUS);
+		//Nodes with only memory don't get workers
+		if(n <= 0) {
+			continue;
+		}
+		topo.node_ids[topo.num_nodes] = ids[i];
+		for(int j = 0; j < n; j++) {
+			topo.cpu_node[node_cpus[j]] = topo.num_nodes;
+		}
+		++topo.num_nodes;
+	}
+	if(topo.num_nodes == 0) {
+		topo.num_nodes = 1;
+		topo.node_ids[0] = 0;
+	}
+	//sysfs lists every CPU in the machine, but taskset, cpusets and containers may only
+	// let us use some of them, and pinning a thread to any other CPU fails
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		printf("Could not read which CPUs we may use\n");
+		return -1;
+	}
+	//Offline and forbidden CPUs were marked by the node lists too, put them back
+	int usable[MAX_CPUS];
+	memset(usable, 0, sizeof(usable));
+	for(int i = 0; i < num_cpus; i++) {
+		usable[cpus[i]] = cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed);
+	}
+	for(int i = 0; i < MAX_CPUS; i++) {
+		if(!usable[i]) {
+			topo.cpu_node[i] = -1;
+		} else if(topo.cpu_node[i] == -1) {
+			topo.cpu_node[i] = 0;
+		}
+	}
+	int node_has_cpus[MAX_NODES];
+	memset(node_has_cpus, 0, sizeof(node_has_cpus));
+	for(int i = 0; i < MAX_CPUS; i++) {
+		if(topo.cpu_node[i] != -1) {
+			node_has_cpus[topo.cpu_node[i]] = 1;
+		}
+	}
+	for(int node = 0; node < topo.num_nodes; node++) {
+		if(!node_has_cpus[node]) {
+			printf("None of node %d's CPUs may be used, run without -n and -l\n", topo.node_ids[node]);
+			return -1;
+		}
+	}
+
+	//A CPU stands for its core if it is the first of its hyperthread siblings we may use
+	int reps[MAX_CPUS];
+	int num_reps = 0;
+	for(int i = 0; i < num_cpus; i++) {
+		int siblings[MAX_CPUS];
+		if(!usable[cpus[i]]) {
+			continue;
+		}
+		sprintf(path, "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpus[i]);
+		int num_siblings = read_list(path, siblings, MAX_CPUS);
+		int first = cpus[i];
+		for(int j = num_siblings - 1; j >= 0; j--) {
+			if(usable[siblings[j]]) {
+				first = siblings[j];
+			}
+		}
+		if(first != cpus[i]) {
+			continue;
+		}
+		reps[num_reps++] = cpus[i];
+	}
+	//Deal the cores out one node at a time, like cards
+	int cursor[MAX_NODES];
+	memset(cursor, 0, sizeof(cursor));
+	while(topo.num_cores < num_reps) {
+		for(int node = 0; node < topo.num_nodes; node++) {
+			while(cursor[node] < num_reps && topo.cpu_node[reps[cursor[node]]] != node) {
+				++cursor[node];
+			}
+			if(cursor[node] < num_reps) {
+				topo.cores[topo.num_cores] = reps[cursor[node]++];
+				topo.core_node[topo.num_cores] = node;
+				++topo.num_cores;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+	 Sets a thread attribute so the thread runs only on one of the cores
+
+	 @param attr: the attribute to give to pthread_create()
+	 @param core: an index into topo.cores
+
+	 @return: 0 on success, an error number on failure
+ */
+int pin_to_core(pthread_attr_t* attr, int core) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(topo.cores[core], &set);
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/*
+	 Sets a thread attribute so the thread runs on any CPU of one node
+
+	 @param attr: the attribute to give to pthread_create()
+	 @param node: the node index, from 0 to topo.num_nodes
+
+	 @return: 0 on success, an error number on failure
+ */
+int pin_to_node(pthread_attr_t* attr, int node) {
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(int i = 0; i < MAX_CPUS; i++) {
+		if(topo.cpu_node[i] == node) {
+			CPU_SET(i, &set);
+		}
+	}
+	return pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+}
+
+/*
+	 Gets memory that lives on a node
+	 The pages are asked for with the kernel's preferred policy, so if the node runs
+	 out they come from another node instead of failing. If the kernel has no NUMA
+	 support the policy is ignored, and the memory is ordinary memory.
+
+	 @param size: how many bytes
+	 @param node: the node index, from 0 to topo.num_nodes
+
+	 @return: the memory, or NULL on failure. It must be given back with node_free()
+ */
+void* node_alloc(size_t size, int node) {
+	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ptr == MAP_FAILED) {
+		return NULL;
+	}
+	unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long)) + 1];
+	memset(mask, 0, sizeof(mask));
+	int id = topo.node_ids[node];
+	mask[id / (8 * sizeof(unsigned long))] |= 1UL << (id % (8 * sizeof(unsigned long)));
+	syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask, sizeof(mask) * 8, 0);
+	return ptr;
+}
+
+void node_free(void* ptr, size_t size) {
+	munmap(ptr, size);
+}
+
+/*
+	 Makes the kernel hand each new connection to the listener of the node whose CPU
+	 received it. The listeners must all share the port with SO_REUSEPORT, and must
+	 have been bound in node order, since the kernel picks them by the order they
+	 joined the group.
+
+	 The filter loads the number of the receiving CPU, and returns that CPU's node.
+	 Anything it doesn't know about gets an index past the end of the group, which
+	 makes the kernel fall back to its usual hash.
+
+	 @param listener: any one of the listeners in the group
+
+	 @return: 0 on success, -1 on failure
+ */
+int steer_to_nodes(int listener) {
+	struct sock_filter code[2 * MAX_CPUS + 2];
+	int n = 0;
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for(int i = 0; i < MAX_CPUS; i++) {
+		if(topo.cpu_node[i] != -1) {
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, i, 0, 1);
+			code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, topo.cpu_node[i]);
+		}
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, MAX_NODES);
+
+	struct sock_fprog prog = { n, code };
+	if(setsockopt(listener, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1) {
+		printf("Could not steer connections to nodes\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,27 @@
+#include <pthread.h>
+
+//The most logical CPUs and memory nodes we keep track of
+#define MAX_CPUS 1024
+#define MAX_NODES 64
+
+//Where worker threads go, discovered from sysfs by discover_topology()
+struct topology {
+	int num_nodes;
+	//the kernel's number for each node, they are not always 0, 1, 2...
+	int node_ids[MAX_NODES];
+	//the node index of every CPU, or -1 if it is offline or we may not run on it
+	int cpu_node[MAX_CPUS];
+	//one CPU from each physical core, interleaved across the nodes
+	int cores[MAX_CPUS];
+	int core_node[MAX_CPUS];
+	int num_cores;
+};
+
+extern struct topology topo;
+
+int discover_topology(void);
+int pin_to_core(pthread_attr_t* attr, int core);
+int pin_to_node(pthread_attr_t* attr, int node);
+void* node_alloc(size_t size, int node);
+void node_free(void* ptr, size_t size);
+int steer_to_nodes(int listener);
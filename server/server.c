@@ -6,29 +6,51 @@ Date: 18-9-2014
 A basic http server
 Given a port, this program will set up an http server on that port. It supports 
 HTTP GET requests.
+
+With -a, directories that have no index.html are served as generated listings,
+see autoindex.c
+
+With -n, every worker thread is pinned to a core, and static files are served
+from a cache on the thread's own NUMA node, see numa.c and content_cache.c
+With -l as well, there is one listener per node, and the kernel hands each
+connection to the listener of the node that received it
  */
 
 #include "get_socket.h"
 #include "handle_connection.h"
+#include "autoindex.h"
+#include "content_cache.h"
+#include "numa.h"
 #include <signal.h>
 #include <pthread.h>
 
 #define MAX_CLIENTS 20
 
+//A listening socket, and the node whose threads take its connections, or -1 for any
+struct listener {
+	int socket;
+	int node;
+	pthread_t thread;
+	//set once its accept thread really exists, so only those are joined
+	int started;
+};
 
-
-//Global root socket, when we catch a SIGINT, we can close this, and the main loop will end
-int root_socket;
+//Global listeners, when we catch a SIGINT, we shut these down, and the accept loops will end
+struct listener listeners[MAX_NODES];
+int num_listeners = 0;
 pthread_t threads[MAX_CLIENTS];
 struct server_thread_attr thread_attrs[MAX_CLIENTS];
 int was_active[MAX_CLIENTS];
+//With -n, the index in topo.cores that each thread is pinned to, otherwise -1
+int thread_core[MAX_CLIENTS];
 
 
 void sighandler(int signum);
 
 /*
-	 When the program receives a sigint, this function is called, it closes the root
-	 socket, and the program shuts down gracefully
+	 When the program receives a sigint, this function is called, it shuts down the
+	 listeners, and the program shuts down gracefully
+	 shutdown() wakes up accept() in every thread, close() would not
  */
 void sighandler(int signum) {
 	if(signum == SIGINT) {
@@ -37,19 +59,132 @@ void sighandler(int signum) {
 		printf("Caught a non-SIGINT signal\n");
 	}
 	printf("Closing root socket\n");
-	close(root_socket);
+	for(int i = 0; i < num_listeners; i++) {
+		shutdown(listeners[i].socket, SHUT_RDWR);
+	}
 }
+
+/*
+	 Gives a new connection to a free thread
+	 Threads are pinned to their core when they are created, if there is one
+
+	 @param con_sock: the socket that was just accepted
+	 @param node: only threads on this node may take it, -1 for any thread
+ */
+void dispatch(int con_sock, int node) {
+	int i;
+	int no_open_threads = 1;
+	for(i = 0; i < MAX_CLIENTS; i++) {
+		if(node != -1 && thread_attrs[i].node != node) {
+			continue;
+		}
+		if(!thread_attrs[i].is_running) {
+			printf("Opening thread %d\n", i);
+			if(was_active[i]) {
+				pthread_join(threads[i], NULL);
+				was_active[i] = 0;
+			}
+			thread_attrs[i].is_running = 1;
+			thread_attrs[i].socket = con_sock;
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			if(thread_core[i] != -1) {
+				pin_to_core(&attr, thread_core[i]);
+			}
+			int result = pthread_create(&threads[i], &attr, handle_connection, (void*)(&thread_attrs[i]));
+			pthread_attr_destroy(&attr);
+			no_open_threads = 0;
+			if(result != 0) {
+				//There is no thread to join, so the slot is free again
+				thread_attrs[i].is_running = 0;
+				close(con_sock);
+				printf("Could not start thread %d, a client was dumped\n", i);
+			} else {
+				was_active[i] = 1;
+			}
+			break;
+		}
+	}
+	if(no_open_threads) {
+		close(con_sock);
+		printf("No open threads were found, a client was dumped. Sorry.\n");
+	}
+}
+
+/*
+	 Accepts connections on a listener until it is shut down
+
+	 @param arg: the listener
+	 @return: NULL
+ */
+void* accept_loop(void* arg) {
+	struct listener* l = (struct listener*)(arg);
+	int con_sock = accept(l->socket, NULL, NULL);
+	while(con_sock != -1) {
+		dispatch(con_sock, l->node);
+		con_sock = accept(l->socket, NULL, NULL);
+	}
+	return NULL;
+}
+
 /*
 	 this is the main function for the HTTP server.
 
  */
 int main(int argc, char* argv[]) {
-	if(argc != 2) {
-		printf("Usage: server PORT\n");
+	int opt;
+	int numa = 0;
+	int steer = 0;
+	while((opt = getopt(argc, argv, "anl")) != -1) {
+		switch(opt) {
+			case 'a':
+				//-a flag, list directories that have no index.html
+				if(autoindex_init() == -1) {
+					return -1;
+				}
+				break;
+			case 'l':
+				//-l flag, one listener per node, which only needs -n
+				steer = 1;
+				numa = 1;
+				break;
+			case 'n':
+				//-n flag, pin threads to cores and cache files per node
+				numa = 1;
+				break;
+			default:
+				printf("Usage: server [-a] [-n] [-l] PORT\n");
+				return -1;
+		}
+	}
+	if(argc - optind != 1) {
+		printf("Usage: server [-a] [-n] [-l] PORT\n");
 		return -1;
 	}
 	memset(&thread_attrs, 0, sizeof(thread_attrs));
 	memset(&was_active, 0, sizeof(was_active));
+	for(int i = 0; i < MAX_CLIENTS; i++) {
+		thread_attrs[i].node = -1;
+		thread_core[i] = -1;
+	}
+
+	//Each thread gets a core, going round the nodes so they all get an even share
+	if(numa) {
+		if(discover_topology() == -1 || content_cache_init(topo.num_nodes) == -1) {
+			return -1;
+		}
+		printf("Found %d nodes with %d cores\n", topo.num_nodes, topo.num_cores);
+		for(int i = 0; i < MAX_CLIENTS; i++) {
+			thread_core[i] = i % topo.num_cores;
+			thread_attrs[i].node = topo.core_node[thread_core[i]];
+		}
+		//The cores go round the nodes, so every node has a thread only if there are enough threads
+		// a node's listener with no threads of its own would drop everything steered to it
+		if(steer && topo.num_nodes > MAX_CLIENTS) {
+			printf("%d nodes but only %d threads, using one listener for all of them\n", topo.num_nodes, MAX_CLIENTS);
+			steer = 0;
+		}
+	}
 
 	//set up the function to handle ^c
 	struct sigaction* act = malloc(sizeof (struct sigaction));
@@ -63,43 +198,50 @@ int main(int argc, char* argv[]) {
 		return -1;
 	} 
 
-	//Basically, it binds the root_socket to ::1
-	int result = get_socket(NULL, argv[1], &root_socket);
-	if(result != 0) {
-		return -1;
-	}
+	//Basically, it binds the listeners to ::1, they must be bound in node order for steer_to_nodes()
+	int wanted = steer ? topo.num_nodes : 1;
+	for(num_listeners = 0; num_listeners < wanted; num_listeners++) {
+		struct listener* l = &listeners[num_listeners];
+		l->node = steer ? num_listeners : -1;
+		int result = get_socket(NULL, argv[optind], &l->socket, steer);
+		if(result != 0) {
+			return -1;
+		}
 
-	int listen_res = listen(root_socket, BACKLOG);
-	if(listen_res == -1) {
-		printf("Listening failed\n");
-		return -1;
+		int listen_res = listen(l->socket, BACKLOG);
+		if(listen_res == -1) {
+			printf("Listening failed\n");
+			return -1;
+		}
 	}
 
-	int con_sock = accept(root_socket, NULL, NULL);
-	while(con_sock != -1) {
-		int i;
-		int no_open_threads = 1;
-		for(i = 0; i < MAX_CLIENTS; i++) {
-			if(!thread_attrs[i].is_running) {
-				printf("Opening thread %d\n", i);
-				if(was_active[i]) {
-					pthread_join(threads[i], NULL);
-				} else {
-					was_active[i] = 1;
-				}
-				thread_attrs[i].is_running = 1;
-				thread_attrs[i].socket = con_sock;
-				pthread_create(&threads[i], NULL, handle_connection, (void*)(&thread_attrs[i]));
-				no_open_threads = 0;
-				break;
+	if(steer) {
+		//If the kernel can't steer, connections are spread by its hash, and still stay on one node
+		steer_to_nodes(listeners[0].socket);
+		for(int i = 0; i < num_listeners; i++) {
+			pthread_attr_t attr;
+			pthread_attr_init(&attr);
+			pin_to_node(&attr, i);
+			listeners[i].started = pthread_create(&listeners[i].thread, &attr, accept_loop, (void*)(&listeners[i])) == 0;
+			pthread_attr_destroy(&attr);
+			if(!listeners[i].started) {
+				//Nobody would accept what the kernel steers to this node, so stop taking connections on it
+				printf("Could not start the listener for node %d\n", i);
+				shutdown(listeners[i].socket, SHUT_RDWR);
 			}
 		}
-		if(no_open_threads) {
-			close(con_sock);
-			printf("No open threads were found, a client was dumped. Sorry.\n");
+		for(int i = 0; i < num_listeners; i++) {
+			if(listeners[i].started) {
+				pthread_join(listeners[i].thread, NULL);
+			}
 		}
-		con_sock = accept(root_socket, NULL, NULL);
+	} else {
+		accept_loop(&listeners[0]);
+	}
+	for(int i = 0; i < num_listeners; i++) {
+		close(listeners[i].socket);
 	}
+
 	printf("Closing all threads\n");
 	for(int i = 0; i < MAX_CLIENTS; i++) {
 		if(was_active[i]) {